@@ -0,0 +1,100 @@
+/* Scaling kernel benchmark
+ * Times kernel_scale() against the ways the compiler would otherwise do the
+ * bend slope: soft-float, and libgcc's generic 16 and 32 bit multiplies.
+ * Also times polar(), which has to fit in the route pass before each poll.
+ * "make bench" flashes this in place of the firmware and reads back the
+ * average cycles per call, stored as little endian words at the start of the
+ * EEPROM in the order of struct results. That overwrites the first preset.
+ */
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+
+#include "scale.h"
+
+#define CALLS 16
+
+struct results
+{
+	uint16_t kernel;
+	uint16_t mulhi3; //16x16 bit product, x has to lose its low bits first to fit
+	uint16_t mulsi3; //32 bit product, exact
+	uint16_t soft_float;
+	uint16_t polar;
+};
+
+//the default bend slope, 4.27 in 8.8 fixed point
+static volatile uint16_t slope = 1092;
+static volatile float slope_float = 4.2666667;
+static volatile uint16_t sink;
+
+static volatile uint16_t overflows;
+
+ISR(TIMER1_OVF_vect)
+{
+	++overflows;
+}
+
+static void timer_start(void)
+{
+	overflows = 0;
+	TCNT1 = 0;
+	TCCR1 = (1<<CS12); //CK/8, so the overflow interrupt costs well under 1%
+}
+
+//average cycles per call since timer_start()
+static uint16_t timer_stop(void)
+{
+	TCCR1 = 0;
+	uint32_t cycles = ((uint32_t)overflows << 8 | TCNT1) << 3;
+	return cycles / CALLS;
+}
+
+static uint16_t input(uint8_t i)
+{
+	return (uint16_t)i << 8 | i << 4 | i; //spread over the 12 bit range
+}
+
+int main(void)
+{
+	struct results r;
+	uint8_t kernel[KERNEL_TERMS];
+
+	kernel_encode(slope, kernel);
+	TIMSK |= (1<<TOIE1);
+	sei();
+
+	timer_start();
+	for(uint8_t i=0;i<CALLS;++i)
+		sink = kernel_scale(input(i), kernel);
+	r.kernel = timer_stop();
+
+	timer_start();
+	for(uint8_t i=0;i<CALLS;++i)
+		sink = (input(i) >> 4) * slope >> 4;
+	r.mulhi3 = timer_stop();
+
+	timer_start();
+	for(uint8_t i=0;i<CALLS;++i)
+		sink = (uint32_t)input(i) * slope >> 8;
+	r.mulsi3 = timer_stop();
+
+	timer_start();
+	for(uint8_t i=0;i<CALLS;++i)
+		sink = input(i) * slope_float;
+	r.soft_float = timer_stop();
+
+	timer_start();
+	for(uint8_t i=0;i<CALLS;++i)
+	{
+		uint16_t angle, magnitude;
+		polar(input(i) - 2048, input(CALLS-1-i) - 2048, &angle, &magnitude);
+		sink = angle + magnitude;
+	}
+	r.polar = timer_stop();
+
+	eeprom_write_block(&r, (void *)0, sizeof(r));
+
+	for(;;);
+}
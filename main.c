@@ -9,8 +9,11 @@
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "usbdrv.h"
+#include "scale.h"
 
 
 
@@ -258,6 +261,115 @@ void usbEventResetReady(void)
 	sei();
 }
 
+// Timer1 free-runs at F_CPU/1024, about 62us per tick, and its overflow
+// interrupt extends the count to 16 bits, about 4 seconds.
+#define TICKS_PER_MS (F_CPU/1024/1000)
+
+static volatile uchar tick_high = 0;
+
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK)
+{
+	++tick_high;
+}
+
+void tick_start(void)
+{
+	TCCR1 = 0b1011; //prescaler 1024
+	TIMSK |= 1 << TOIE1;
+}
+
+uint16_t ticks(void)
+{
+	uchar high, low;
+	do
+	{
+		high = tick_high;
+		low = TCNT1;
+	}
+	while(high != tick_high); //overflowed while reading, try again
+	return (uint16_t)high << 8 | low;
+}
+
+// The host polls endpoint 1 on a fixed schedule, and the driver tells us
+// (via USB_INTR1_SENT_HOOK) when it has collected a packet. If that packet
+// was armed straight after the previous collection, the gap between the two
+// is exactly one poll period, which is averaged into poll_period. From then
+// on next_poll predicts the host's next IN token, so anything whose contents
+// depend on the latest sample can be built just before it is collected
+// instead of sitting in the buffer for most of a period.
+// Once everything is built in that window, packets are armed just before a
+// poll rather than just after one. The gap since the last collection is
+// still a whole number of periods, so when it is close to one it nudges the
+// period a quarter tick towards what it says and the schedule keeps
+// tracking the host.
+#define POLL_PERIOD_MIN (2*TICKS_PER_MS) //anything shorter is not a real period
+#define POLL_PERIOD_MAX ((USB_CFG_INTR_POLL_INTERVAL+6)*TICKS_PER_MS)
+#define POLL_PROMPT (1*TICKS_PER_MS) //armed this soon after a poll, the packet goes out on the next one
+#define POLL_LEAD (TICKS_PER_MS/2) //how long before the poll to sample and build
+#define POLL_MULTIPLES 4 //longest gap that still counts, in periods
+#define POLL_SLACK (TICKS_PER_MS/4) //how far from a whole number of periods it may be
+
+static uint16_t last_poll = 0;
+static uint16_t next_poll = 0;
+static uint16_t poll_period_acc = 0; //period << 2, 0 until one has been seen
+static _Bool armed_promptly = 0;
+
+void usbEventInterruptSent(void)
+{
+	uint16_t now = ticks();
+	uint16_t gap = now - last_poll;
+	uint16_t period = poll_period_acc >> 2;
+	if(armed_promptly)
+	{
+		if(gap >= POLL_PERIOD_MIN && gap <= POLL_PERIOD_MAX)
+		{
+			if(poll_period_acc)
+				poll_period_acc += gap - period;
+			else
+				poll_period_acc = gap << 2;
+		}
+	}
+	else if(period)
+	{
+		uint16_t whole = period;
+		for(uchar k=1;k<POLL_MULTIPLES && gap > whole + (period >> 1);++k)
+			whole += period;
+		int16_t error = gap - whole;
+		if(error > 0 && error <= POLL_SLACK)
+			++poll_period_acc;
+		else if(error < 0 && error >= -POLL_SLACK)
+			--poll_period_acc;
+	}
+	last_poll = now;
+	next_poll = now + (poll_period_acc >> 2);
+}
+
+//call after every usbSetInterrupt() so the next collection can be judged
+void poll_armed(void)
+{
+	armed_promptly = (uint16_t)(ticks() - last_poll) < POLL_PROMPT;
+}
+
+//ticks until the host's next expected poll, 0 if the schedule isn't known yet
+uint16_t ticks_to_poll(void)
+{
+	uint16_t period = poll_period_acc >> 2;
+	if(!period)
+		return 0;
+
+	uint16_t now = ticks();
+	while((int16_t)(next_poll - now) < 0) //that poll has been and gone, predict the one after
+		next_poll += period;
+
+	return next_poll - now;
+}
+
+//true when the next poll is close enough to build its packet now, or when the schedule isn't known yet
+_Bool poll_window_open(void)
+{
+	return ticks_to_poll() <= POLL_LEAD;
+}
+
 //uchar note = 0;
 
 typedef union
@@ -273,12 +385,271 @@ typedef union
 }
 USB_midi_msg;
 
+// Direction thresholds are 7 bit margins measured from the rail the
+// direction points at, in units of 1/128 of full scale. A direction is
+// entered when the stick gets closer to its rail than the enter margin and
+// only left again once it backs off past the (wider) exit margin.
+#define DEFAULT_ENTER_THRESHOLD 16 //1/8 of the travel, the old fixed 32/224
+#define DEFAULT_EXIT_THRESHOLD 20
+
+#define AXIS_UD 0 //PB3, ADC3
+#define AXIS_LR 1 //PB4, ADC2
+
+#define CURVE_BYTES ((2*CURVE_POINTS+3) & ~3) //both axes' curves, padded to whole records
+
+// A route sends one axis, or the low or high half of it, to a continuous
+// destination. Each is a 4 byte record of 7 bit values so the raw record CCs
+// can write it. The source is 12 bits: the sample, or the curve's output
+// with OPTION_CURVES, and a half is its distance from the center doubled.
+// Routes with no destination are skipped, which is what the EEPROM reads as
+// until one is written.
+#define ROUTES 4
+
+#define ROUTE_NONE 0
+#define ROUTE_PITCH_BEND 1 //a half bends down for low and up for high from the center
+#define ROUTE_CC 2
+#define ROUTE_CC14 3 //number and number+32, number is 0-31
+#define ROUTE_CHAN_PRESS 4
+#define ROUTE_POLY_PRESS 5 //number is the note
+#define ROUTE_CC_RELATIVE 6 //64 plus the change since the last send, for an endless angle
+
+
+#define ROUTE_WHOLE 0
+#define ROUTE_LOW 1
+#define ROUTE_HIGH 2
+#define ROUTE_POLAR 3 //axis picks POLAR_MAGNITUDE or POLAR_ANGLE of the deflection instead
+
+// For ROUTE_POLAR the magnitude is the distance from the center doubled,
+// saturating past the edge of the circle, and the angle is 12 bits of a
+// turn starting at the high end of LR and going towards the high end of UD.
+// Close to the center the angle is noise, so it holds below POLAR_HOLD.
+#define POLAR_MAGNITUDE 0
+#define POLAR_ANGLE 1
+#define POLAR_HOLD (SAMPLE_CENTER/8)
+
+// A route's last byte keeps it from flooding the host. A new value goes out
+// only once it differs from the last one sent by 1 << min_delta steps of the
+// destination, and no sooner than ROUTE_RATE_TICKS << rate since the last
+// send, 0 being no cap. With keep_alive set the value is resent anyway after
+// ROUTE_KEEP_ALIVE_TICKS << (keep_alive-1) without a send, which also
+// settles a value held back by min_delta.
+#define ROUTE_RATE_TICKS (10*TICKS_PER_MS) //20, 40 or 80ms
+#define ROUTE_KEEP_ALIVE_TICKS (250*TICKS_PER_MS) //250ms, 500ms or 1s
+
+typedef union
+{
+	uchar bytes[4];
+	struct
+	{
+		uchar destination:3;
+		uchar axis:1; //AXIS_UD or AXIS_LR
+		uchar half:2;
+		uchar :2;
+		uchar channel:4;
+		uchar :4;
+		uchar number; //controller or note
+		uchar min_delta:3;
+		uchar rate:2;
+		uchar keep_alive:2;
+	};
+}
+route;
+
 static union
 {
-	uchar bytes[32];
-	USB_midi_msg direction_lookup_table[8];	
+	uchar bytes[76 + CURVE_BYTES + 4*ROUTES + 4];
+	struct
+	{
+		//cardinals enter at 0-3 and leave at 4-7, diagonals enter at 8-11 and leave at 12-15
+		USB_midi_msg direction_lookup_table[16];
+		uchar enter_threshold[4]; //up, down, left, right, diagonals use their up or down entry
+		uchar exit_threshold[4];
+		uchar options;
+		//OPTION_NOTES settings
+		uchar note_root; //lowest note
+		uchar note_scale:3; //index into note_scales
+		uchar note_axis:1; //AXIS_UD or AXIS_LR picks the note
+		uchar note_gate:1; //NOTE_GATE_CENTER or NOTE_GATE_AXIS
+		uchar :3;
+		uchar note_channel:4;
+		uchar note_octaves:3; //one less than the octaves the axis spans
+		uchar :1;
+		uchar curve[2][CURVE_POINTS]; //response curves indexed by AXIS_UD and AXIS_LR, see scale.h
+		uchar layout; //PRESET_LAYOUT once presets_migrate() has seen the preset
+		uchar curve_pad[CURVE_BYTES - 2*CURVE_POINTS - 1]; //so the routes start on a record
+		route routes[ROUTES];
+		uchar velocity_fast; //ms from leaving the center to a direction that gives velocity 127, 0 keeps the fixed velocities
+		uchar velocity_min; //velocity for the slowest travel
+		uchar slew[2]; //2 bits per route then the OPTION_PITCH_BEND bend, 7 bits to a byte, see slew()
+	};
+}
+current_program = {
+	.direction_lookup_table[0] = {.packet_header = 0x09, .midi_header = 0x90, .midi_arg1 = 42, .midi_arg2 = 42},
+	.enter_threshold = {DEFAULT_ENTER_THRESHOLD, DEFAULT_ENTER_THRESHOLD, DEFAULT_ENTER_THRESHOLD, DEFAULT_ENTER_THRESHOLD},
+	.exit_threshold = {DEFAULT_EXIT_THRESHOLD, DEFAULT_EXIT_THRESHOLD, DEFAULT_EXIT_THRESHOLD, DEFAULT_EXIT_THRESHOLD},
+};
+
+// The EEPROM holds NUM_PRESETS copies of current_program back to back. The
+// configuration CCs address it in 4 byte records, so a preset's record n
+// lives at record preset*PRESET_SIZE/4 + n.
+#define NUM_PRESETS 4 //must be a power of two
+#define PRESET_SIZE sizeof(current_program)
+
+_Static_assert(offsetof(__typeof__(current_program), routes) % 4 == 0, "routes must be whole records");
+
+// calibration.htm writes a 48 byte block over SysEx (F0 12 34 ... F7): four
+// IEEE754 floats for the slope of each half axis, then four int16 dead zone
+// edges and four int16 bend limits, all little endian and in terms of the
+// 10 bit ADC, then the four slopes again as scaling kernels (see scale.h).
+// It lives at the top of the EEPROM, above the presets.
+#define CALIBRATION_SIZE 48
+#define CALIBRATION_ADDR (E2END + 1 - CALIBRATION_SIZE)
+
+_Static_assert(NUM_PRESETS * PRESET_SIZE <= CALIBRATION_ADDR, "presets overlap the calibration block");
+
+// Older firmware kept 16 presets of only the eight cardinal entries, 32
+// bytes each, and EESAVE keeps the EEPROM across a reflash. Read with this
+// layout those bytes would turn into options, thresholds and curves, so
+// every preset carries PRESET_LAYOUT, a value no 7 bit record write can
+// produce, and one without it is migrated at startup: old preset p's
+// entries move from p*32 to its cardinal entries here and the rest of it
+// is cleared back to unprogrammed. Going from the last preset down, each
+// copy lands above every old preset still to be moved. The marker goes
+// in last, so a migration cut short starts that preset over. Change
+// PRESET_LAYOUT whenever the layout changes.
+#define PRESET_LAYOUT 0xa1
+#define OLD_PRESET_SIZE (8*sizeof(USB_midi_msg))
+
+void presets_migrate(void)
+{
+	uchar p = NUM_PRESETS;
+	while(p--)
+	{
+		uchar *preset = (uchar *)(p * PRESET_SIZE);
+		uchar *layout = preset + offsetof(__typeof__(current_program), layout);
+		if(eeprom_read_byte(layout) == PRESET_LAYOUT)
+			continue;
+		const uchar *old = (const uchar *)(p * OLD_PRESET_SIZE);
+		for(uchar i=0;i<PRESET_SIZE;++i)
+			eeprom_update_byte(preset + i, i < OLD_PRESET_SIZE ? eeprom_read_byte(old + i) : 0xff);
+		if(!p) //old presets 14 and 15 sat where the calibration block is now, and could pass for one
+			for(uchar i=0;i<CALIBRATION_SIZE;++i)
+				eeprom_update_byte((uchar *)CALIBRATION_ADDR + i, 0xff);
+		eeprom_write_byte(layout, PRESET_LAYOUT);
+	}
+}
+
+//bits in current_program.options
+#define OPTION_EIGHT_WAY 0x01 //report the diagonals as directions of their own
+#define OPTION_PITCH_BEND 0x02 //send continuous pitch bend from the calibration instead of direction events
+#define OPTION_CURVES 0x04 //bend and route through the preset's response curves instead of the calibration and the raw axes
+#define OPTION_NOTES 0x08 //play the preset's scale from one axis instead of direction events
+
+// One pass over the routes turns a sample into a batch of packets, which
+// fill whatever room the queued events leave in each transfer, and a route
+// only makes packets when route_due() says so. Every transfer gets a fresh
+// pass, and a value for a (cable, channel, status, controller) that still
+// has one waiting in the batch replaces it in place, so the batch never
+// holds more than one value per controller and none is more than a poll
+// old, however many routes there are. A 14 bit CC's MSB and LSB are marked
+// in stream_pairs and only ever go out together, so the host never sees
+// half of a new value. They are kept at an even offset, so two transfers of
+// nothing but stream never leave a slot empty for them.
+static USB_midi_msg stream_batch[2*ROUTES+2]; //+1 for the OPTION_PITCH_BEND bend, +1 for a sent packet kept to hold pairs even
+static uchar stream_batch_len = 0;
+static uchar stream_batch_pos = 0;
+static uint16_t stream_pairs = 0; //bit n set when batch entry n starts a pair
+static uint16_t route_last[ROUTES+1]; //value last sent by each route then the OPTION_PITCH_BEND bend
+static uint16_t route_sent[ROUTES+1]; //ticks() when they were sent
+static uint16_t route_slewed[ROUTES+1]; //where slew() has got each route to
+
+//make the next pass start over and resend every route
+void stream_reset(void)
+{
+	stream_batch_len = 0;
+	stream_batch_pos = 0;
+	stream_pairs = 0;
+	memset(route_last, 0xff, sizeof(route_last));
+	memset(route_slewed, 0xff, sizeof(route_slewed));
+}
+
+// Note mode plays the preset's scale from the position on one axis. The
+// axis spans note_octaves+1 octaves, each cut into NOTE_ZONES equal zones
+// that note_zones maps to the semitone of a scale degree. So per sample the
+// note is a scaling kernel and a table lookup, whatever the scale or range.
+// Scales are bitmasks of the semitones above the root. A semitone fits in
+// a nibble, so note_zones holds two zones a byte, the even zone low.
+#define NOTE_ZONES 32
+#define NOTE_GATE_CENTER 0 //sound while the stick is out of the center, as the directions see it
+#define NOTE_GATE_AXIS 1 //sound while the other axis is pushed either way past its up threshold
+
+const PROGMEM uint16_t note_scales[8] = {
+	0xfff, //chromatic
+	0xab5, //major
+	0x5ad, //natural minor
+	0x295, //major pentatonic
+	0x4a9, //minor pentatonic
+	0x4e9, //blues
+	0x6ad, //dorian
+	0x9ad, //harmonic minor
+};
+
+static uchar note_zones[NOTE_ZONES/2];
+static uint8_t note_kernel[KERNEL_TERMS]; //12 bit sample to 1/256ths of an octave
+
+void note_setup(void)
+{
+	uchar degrees[12];
+	uchar count = 0;
+	uint16_t scale = pgm_read_word(&note_scales[current_program.note_scale]);
+	for(uchar i=0;i<12;++i)
+		if(scale & (1 << i))
+			degrees[count++] = i;
+
+	//zone i plays degree i*count/NOTE_ZONES
+	uint16_t acc = 0;
+	for(uchar i=0;i<NOTE_ZONES;i+=2)
+	{
+		note_zones[i >> 1] = degrees[acc / NOTE_ZONES];
+		acc += count;
+		note_zones[i >> 1] |= degrees[acc / NOTE_ZONES] << 4;
+		acc += count;
+	}
+
+	kernel_encode((current_program.note_octaves + 1) << 4, note_kernel);
+}
+
+// Velocity comes from how long the stick took to get from leaving the
+// center to entering a direction, velocity = 127 * velocity_fast / time.
+// The time in ticks is bucketed by its top three bits, four buckets to the
+// octave from 1ms to 256ms. velocity_recip holds 65536 over the middle of
+// each bucket, and velocity_setup() makes the rest, 127 * 16 ticks/ms *
+// velocity_fast / 65536, into a scaling kernel. So a note on costs a leading
+// bit search, a lookup and a kernel, and nothing is divided at run time.
+#define VELOCITY_BUCKETS 32
+#define VELOCITY_MIDDLE(i) (((4 + ((i) & 3)) << (((i) >> 2) + 2)) + (1 << (((i) >> 2) + 1)))
+#define VELOCITY_RECIP(i) (uint16_t)(65536UL / VELOCITY_MIDDLE(i))
+#define VELOCITY_OCTAVE(o) VELOCITY_RECIP(4*(o)), VELOCITY_RECIP(4*(o)+1), VELOCITY_RECIP(4*(o)+2), VELOCITY_RECIP(4*(o)+3)
+
+const PROGMEM uint16_t velocity_recip[VELOCITY_BUCKETS] = {
+	VELOCITY_OCTAVE(0), VELOCITY_OCTAVE(1), VELOCITY_OCTAVE(2), VELOCITY_OCTAVE(3),
+	VELOCITY_OCTAVE(4), VELOCITY_OCTAVE(5), VELOCITY_OCTAVE(6), VELOCITY_OCTAVE(7),
+};
+
+static uint8_t velocity_kernel[KERNEL_TERMS];
+
+void velocity_setup(void)
+{
+	kernel_encode(((current_program.velocity_fast & 0x7f) * 127) >> 4, velocity_kernel); //8.8, at most 1008
+}
+
+//velocity for a travel time in one of the buckets
+static uchar velocity_at(uchar bucket)
+{
+	uchar min = current_program.velocity_min ? current_program.velocity_min & 0x7f : 1;
+	uint16_t velocity = kernel_scale(pgm_read_word(&velocity_recip[bucket]), velocity_kernel);
+	return velocity > 127 ? 127 : velocity < min ? min : velocity;
 }
-current_program = {.direction_lookup_table[0] = {.packet_header = 0x09, .midi_header = 0x90, .midi_arg1 = 42, .midi_arg2 = 42}};
 
 typedef union
 {
@@ -302,12 +673,6 @@ typedef union
 	uchar *ptr;
 	uint16_t addr;
 	struct
-	{
-		uint16_t offset:2;
-		uint16_t direction:3;
-		uint16_t preset:4;
-	};
-	struct
 	{
 		uint16_t _:2;
 		uint16_t index:7;
@@ -335,34 +700,135 @@ current_prog = {.bytes = {0}};
 
 void change_program(uchar prog)
 {
-	config_loc loc = {.preset = prog & 0xf};//only 16 presets possible
+	config_loc loc = {.addr = (prog & (NUM_PRESETS-1)) * PRESET_SIZE};
 
-	//copy the 32 byte table for the preset into ram
-	for(uchar i=0;i<32;++i)
+	//copy the preset into ram
+	for(uchar i=0;i<PRESET_SIZE;++i)
 	{
 		uchar byte = eeprom_read_byte(loc.ptr+i);
 		if(byte==0xff)
 			byte = 0;
 		current_program.bytes[i]=byte;
 	}
+
+	//unprogrammed or nonsense thresholds fall back to the defaults, they can't reach past the center
+	for(uchar i=0;i<4;++i)
+	{
+		if(current_program.enter_threshold[i] == 0 || current_program.enter_threshold[i] >= 60)
+			current_program.enter_threshold[i] = DEFAULT_ENTER_THRESHOLD;
+		if(current_program.exit_threshold[i] <= current_program.enter_threshold[i] || current_program.exit_threshold[i] >= 64)
+			current_program.exit_threshold[i] = current_program.enter_threshold[i] + (DEFAULT_EXIT_THRESHOLD - DEFAULT_ENTER_THRESHOLD);
+	}
+
+	//an unprogrammed curve still has erased ends, which no 7 bit point can be, make it the
+	//same as the default calibration, a straight line on LR and flat on UD
+	for(uchar i=0;i<2;++i)
+	{
+		const uchar *curve = loc.ptr + offsetof(__typeof__(current_program), curve) + i*CURVE_POINTS;
+		if(eeprom_read_byte(curve) != 0xff || eeprom_read_byte(curve + CURVE_POINTS-1) != 0xff)
+			continue;
+		for(uchar j=0;j<CURVE_POINTS;++j)
+			current_program.curve[i][j] = i == AXIS_LR ? (j == CURVE_POINTS-1 ? 127 : j << (CURVE_SEGMENT_BITS - 5)) : 64;
+	}
+
+	stream_reset();
+	note_setup();
+	velocity_setup();
 }
 
 static _Bool toggle_mode = 0;
 
+#define SYSEX_ID 0x12
+#define SYSEX_WRITE_CALIBRATION 0x34
+#define SYSEX_CALIBRATION_MODE 0x35
+
+static _Bool calibration_written = 0;
+static _Bool calibration_mode = 0; //stream the raw axes as 0xE1/0xE2 for calibration.htm
+
+// calibration.htm packs each pair of bytes into three 7 bit ones, the first
+// holding their top bits
+void sysex_byte(uchar byte)
+{
+	static uchar pos = 0; //bytes seen since F0, 0 when not in a SysEx
+	static uchar command;
+	static uchar top_bits;
+	static uchar addr;
+
+	if(byte == 0xF0)
+	{
+		pos = 1;
+		return;
+	}
+	if(!pos)
+		return;
+	if(byte & 0x80)
+	{
+		if(byte == 0xF7)
+		{
+			if(command == SYSEX_CALIBRATION_MODE && pos == 3)
+				calibration_mode = !calibration_mode;
+			if(command == SYSEX_WRITE_CALIBRATION && addr)
+				calibration_written = 1;
+		}
+		pos = 0;
+		return;
+	}
+
+	switch(pos)
+	{
+	case 1:
+		if(byte != SYSEX_ID)
+		{
+			pos = 0;
+			return;
+		}
+		break;
+	case 2:
+		command = byte;
+		addr = 0;
+		break;
+	case 3:
+		top_bits = byte;
+		break;
+	default:
+		if(command == SYSEX_WRITE_CALIBRATION && addr < CALIBRATION_SIZE)
+		{
+			if(top_bits & 1)
+				byte |= 0x80;
+			top_bits >>= 1;
+			eeprom_write_byte((uchar *)CALIBRATION_ADDR + addr, byte);
+			++addr;
+		}
+		if(pos == 5) //next triplet
+			pos = 2;
+		break;
+	}
+	++pos;
+}
+
 
 #define RUNTIME_TYPE_CONFIG_CODE 16
 #define RUNTIME_ARG1_CONFIG_CODE 24
 #define RUNTIME_ARG2_CONFIG_CODE 32
+#define RUNTIME_DIAG_TYPE_CONFIG_CODE 48
+#define RUNTIME_DIAG_ARG1_CONFIG_CODE 56
+#define RUNTIME_DIAG_ARG2_CONFIG_CODE 64
 #define EEPROM_CONFIG_CODE 40
+#define EEPROM_RAW_CONFIG_CODE 44
 #define MODE_SWAP_CODE 15
 
-void usbFunctionWriteOut(uchar * data, uchar len)
+void handle_midi_packet(uchar * data)
 {
 	static config_loc loc = {.addr=0};
 
-	//if its not a controller message on virt cable 0 bail
-	if(len != 4)
+	//SysEx start, continue and end packets carry 3, 1, 2 and 3 bytes
+	if(data[0] >= 0x04 && data[0] <= 0x07)
+	{
+		uchar count = data[0] == 0x05 ? 1 : data[0] == 0x06 ? 2 : 3;
+		for(uchar i=0;i<count;++i)
+			sysex_byte(data[1+i]);
 		return;
+	}
 
 	//program change
 	if(data[0] == 0x0C && data[1] == 0xC0)
@@ -417,6 +883,13 @@ void usbFunctionWriteOut(uchar * data, uchar len)
 		break;
 #endif
 
+#ifdef EEPROM_RAW_CONFIG_CODE
+	case EEPROM_RAW_CONFIG_CODE ... EEPROM_RAW_CONFIG_CODE+3:
+		//write a byte of the record selected by EEPROM_CONFIG_CODE as is, for thresholds
+		eeprom_write_byte(loc.ptr+data[2]-EEPROM_RAW_CONFIG_CODE,config);
+		break;
+#endif
+
 #ifdef RUNTIME_ARG1_CONFIG_CODE
 	case RUNTIME_ARG1_CONFIG_CODE ... RUNTIME_ARG1_CONFIG_CODE+7:
 		current_program.direction_lookup_table[data[2]-RUNTIME_ARG1_CONFIG_CODE].bytes[2] = config;
@@ -442,6 +915,32 @@ void usbFunctionWriteOut(uchar * data, uchar len)
 		}
 		break;
 #endif
+
+#ifdef RUNTIME_DIAG_ARG1_CONFIG_CODE
+	case RUNTIME_DIAG_ARG1_CONFIG_CODE ... RUNTIME_DIAG_ARG1_CONFIG_CODE+7:
+		current_program.direction_lookup_table[data[2]-RUNTIME_DIAG_ARG1_CONFIG_CODE+8].bytes[2] = config;
+		break;
+#endif
+
+#ifdef RUNTIME_DIAG_ARG2_CONFIG_CODE
+	case RUNTIME_DIAG_ARG2_CONFIG_CODE ... RUNTIME_DIAG_ARG2_CONFIG_CODE+7:
+		current_program.direction_lookup_table[data[2]-RUNTIME_DIAG_ARG2_CONFIG_CODE+8].bytes[3] = config;
+		break;
+#endif
+
+#ifdef RUNTIME_DIAG_TYPE_CONFIG_CODE
+	case RUNTIME_DIAG_TYPE_CONFIG_CODE ... RUNTIME_DIAG_TYPE_CONFIG_CODE+7:
+		if(0xf == usb_midi_header)
+		{
+			current_program.direction_lookup_table[data[2]-RUNTIME_DIAG_TYPE_CONFIG_CODE+8].bytes[0] = 0;
+		}
+		else
+		{
+			current_program.direction_lookup_table[data[2]-RUNTIME_DIAG_TYPE_CONFIG_CODE+8].bytes[0] = usb_midi_header;
+			current_program.direction_lookup_table[data[2]-RUNTIME_DIAG_TYPE_CONFIG_CODE+8].bytes[1] = type;
+		}
+		break;
+#endif
 		
 	}
 /*
@@ -453,6 +952,13 @@ void usbFunctionWriteOut(uchar * data, uchar len)
 	}
 */}
 
+void usbFunctionWriteOut(uchar * data, uchar len)
+{
+	//a transfer can carry two event packets
+	for(;len >= 4;len -= 4, data += 4)
+		handle_midi_packet(data);
+}
+
 typedef enum
 {
 	CENTER,
@@ -460,40 +966,1021 @@ typedef enum
 	DOWN,
 	LEFT,
 	RIGHT,
+	UP_LEFT,
+	UP_RIGHT,
+	DOWN_LEFT,
+	DOWN_RIGHT,
 }
 Position;
 
-uchar get_pos(void)
+//where entering or leaving a direction sits in direction_lookup_table
+#define ENTER_INDEX(dir) ((((dir)-1) & 3) | ((((dir)-1) & 4) << 1))
+#define LEAVE_INDEX(dir) (ENTER_INDEX(dir) | 4)
+
+
+#define ADMUX_UD 0b11 //select reading from PB3, right adjusted so all 10 bits are kept
+#define ADMUX_LR 0b10 //select reading from PB4
+
+// Samples are always delivered as 12 bit values (0 to SAMPLE_MAX) whatever
+// the oversampling, so everything downstream works on one scale. Each
+// sample is the sum of ADC_OVERSAMPLE back to back conversions of one axis,
+// decimated to 12 bits. 16x oversampling gives the two extra bits for real
+// on a noisy stick, 1x just scales the raw 10 bit reading.
+#define ADC_OVERSAMPLE 1 //1, 4 or 16 conversions per sample
+
+#define SAMPLE_BITS 12
+#define SAMPLE_MAX ((1<<SAMPLE_BITS) - 1)
+
+#if ADC_OVERSAMPLE == 1
+#define ADC_DECIMATE(sum) ((sum) << 2)
+#elif ADC_OVERSAMPLE == 4
+#define ADC_DECIMATE(sum) (sum)
+#elif ADC_OVERSAMPLE == 16
+#define ADC_DECIMATE(sum) ((sum) >> 2)
+#else
+#error "ADC_OVERSAMPLE must be 1, 4 or 16"
+#endif
+
+// Timer0 runs in CTC mode and its compare match A auto-triggers the ADC, so
+// samples are evenly spaced no matter what the USB side is doing. The
+// conversions alternate between the two axes, so the trigger runs at twice
+// the per axis rate, times the oversampling.
+#define SAMPLE_RATE 1000 //samples per second per axis, 1000, 2000 and 4000 are sensible, at most 500 with 16x oversampling
+
+#define ADC_TRIGGER_TOP (F_CPU/64/(2*SAMPLE_RATE*ADC_OVERSAMPLE) - 1) //timer0 is clocked at F_CPU/64
+
+#if ADC_TRIGGER_TOP > 255
+#error "SAMPLE_RATE too low for timer0"
+#endif
+#if ADC_TRIGGER_TOP < 13
+#error "SAMPLE_RATE too high, a conversion takes 13 ADC clocks"
+#endif
+
+// The ADC interrupt alternates between the two axes by itself and pushes
+// each finished pair into a small ring which the main loop drains.
+#define SAMPLE_RING_SIZE 8 //must be a power of two
+
+static volatile uint16_t sample_ring[SAMPLE_RING_SIZE][2];
+static volatile uchar sample_head = 0;
+static volatile uchar sample_tail = 0;
+static volatile uchar sample_overruns = 0;
+
+// nonblocking so the USB interrupt can preempt us at any point
+ISR(ADC_vect, ISR_NOBLOCK)
 {
-	ADMUX = (1<<ADLAR) | 0b11; //select reading from PB3
+	static uint16_t sum = 0; //16 conversions of 10 bits fit easily
+	static uchar count = 0;
+	static uint16_t pending_ud;
 
-	ADCSRA |= (1<<ADSC) | (1 << ADIF); //clear interrupt flag and start conversion
+	TIFR = 1<<OCF0A; //the trigger is edge sensitive, so the flag has to be cleared for the next one
 
-	while(!(ADCSRA & (1<<ADIF))) //busy loop waiting for conversion to finish
-		;
+	sum += ADC;
+	if(++count < ADC_OVERSAMPLE)
+		return;
+
+	uint16_t value = ADC_DECIMATE(sum);
+	sum = 0;
+	count = 0;
 
-	if(ADCH<32)
-		return UP;
+	if(ADMUX == ADMUX_UD)
+	{
+		pending_ud = value;
+		ADMUX = ADMUX_LR;
+	}
+	else
+	{
+		ADMUX = ADMUX_UD;
 
-	if(ADCH>224)
-		return DOWN;
+		uchar head = sample_head;
+		uchar next = (head + 1) & (SAMPLE_RING_SIZE - 1);
+		if(next == sample_tail)
+		{
+			//main loop fell behind, drop this pair
+			++sample_overruns;
+			return;
+		}
+		sample_ring[head][AXIS_UD] = pending_ud;
+		sample_ring[head][AXIS_LR] = value;
+		sample_head = next; //publish the finished pair
+	}
+}
 
-	ADMUX = (1<<ADLAR) | 0b10; //select reading from PB4
+void adc_start(void)
+{
+	OCR0A = ADC_TRIGGER_TOP;
+	TCCR0A = 1 << WGM01; //CTC mode
+	TCCR0B = 1 << CS01 | 1 << CS00; //prescaler 64
 
-	ADCSRA |= (1<<ADSC) | (1<< ADIF); //clear interrupt flag and start conversion
+	ADMUX = ADMUX_UD;
+	ADCSRB = 1 << ADTS1 | 1 << ADTS0; //trigger on timer0 compare match A
+	ADCSRA = 1 << ADEN | 1 << ADATE | 1 << ADIE | 0b110; //enable ADC with interrupt and auto trigger, set prescaler to 6 (divide by 64)
+}
 
-	while(!(ADCSRA & (1<<ADIF))) //busy loop waiting for conversion to finish
-		;
+//copy the oldest unread pair out of the ring, returns 0 if there is none
+_Bool next_sample(uint16_t sample[2])
+{
+	uchar tail = sample_tail;
+	if(tail == sample_head)
+		return 0;
+
+	sample[AXIS_UD] = sample_ring[tail][AXIS_UD];
+	sample[AXIS_LR] = sample_ring[tail][AXIS_LR];
+	sample_tail = (tail + 1) & (SAMPLE_RING_SIZE - 1);
+	return 1;
+}
 
-	if(ADCH<32)
-		return LEFT;
+// Every sample goes through a per axis filter before anything looks at it,
+// so a single glitched conversion can't cause a spurious transition. First a
+// running median throws away outliers, then a one pole IIR smooths what is
+// left. Both are compares, adds and shifts only, the ATtiny85 has no MUL.
+#define FILTER_MEDIAN 3 //window length, 0 to disable, 3 or 5
+#define FILTER_IIR_SHIFT 2 //the IIR moves 1/2^n of the way to each new sample, 0 to disable
 
-	if(ADCH>224)
-		return RIGHT;
+#if FILTER_MEDIAN != 0 && FILTER_MEDIAN != 3 && FILTER_MEDIAN != 5
+#error "FILTER_MEDIAN must be 0, 3 or 5"
+#endif
+#if FILTER_IIR_SHIFT > 4
+#error "FILTER_IIR_SHIFT too large, the accumulator would overflow 16 bits"
+#endif
+
+typedef struct
+{
+#if FILTER_MEDIAN
+	uint16_t window[FILTER_MEDIAN];
+	uchar next;
+#endif
+#if FILTER_IIR_SHIFT
+	uint16_t acc; //filter output << FILTER_IIR_SHIFT
+#endif
+}
+axis_filter;
+
+static axis_filter filters[2];
+
+#define SORT2(a,b) if((a) > (b)) { uint16_t t = (a); (a) = (b); (b) = t; }
+
+#if FILTER_MEDIAN == 3
+static uint16_t median(const uint16_t *w)
+{
+	uint16_t a = w[0], b = w[1], c = w[2];
+	SORT2(a,b);
+	if(b > c)
+		b = c;
+	return a > b ? a : b;
+}
+#elif FILTER_MEDIAN == 5
+static uint16_t median(const uint16_t *w)
+{
+	//fixed 7 compare exchange network
+	uint16_t a = w[0], b = w[1], c = w[2], d = w[3], e = w[4];
+	SORT2(a,b); SORT2(d,e); SORT2(a,d);
+	SORT2(b,e); SORT2(b,c); SORT2(c,d);
+	SORT2(b,c);
+	return c;
+}
+#endif
+
+//start the filter off settled on the given value
+void filter_init(axis_filter *f, uint16_t value)
+{
+#if FILTER_MEDIAN
+	for(uchar i=0;i<FILTER_MEDIAN;++i)
+		f->window[i] = value;
+	f->next = 0;
+#endif
+#if FILTER_IIR_SHIFT
+	f->acc = value << FILTER_IIR_SHIFT;
+#endif
+}
+
+uint16_t filter_sample(axis_filter *f, uint16_t value)
+{
+#if FILTER_MEDIAN
+	f->window[f->next] = value;
+	if(++f->next == FILTER_MEDIAN)
+		f->next = 0;
+	value = median(f->window);
+#endif
+#if FILTER_IIR_SHIFT
+	f->acc += value - (f->acc >> FILTER_IIR_SHIFT);
+	value = f->acc >> FILTER_IIR_SHIFT;
+#endif
+	return value;
+}
+
+// A direction can be fired before the stick actually reaches its threshold.
+// Each axis' velocity is tracked from successive filtered samples, and if
+// the position projected a few samples ahead is past the threshold while the
+// host's next poll would come before the real crossing, the direction is
+// entered early. If the stick turns back before it really gets there, the
+// projection falls out of the direction again and it is released. If it
+// stalls short of the threshold instead, the direction is released once
+// the samples the projection looked ahead have gone by, and nothing is
+// predicted again until the projection has fallen back to the center.
+#define PREDICT_CROSSINGS 1
+#define PREDICT_SHIFT 2 //look 2^n samples ahead, about one sample plus the filter delay
+
+#define TICKS_PER_SAMPLE (TICKS_PER_MS*1000/SAMPLE_RATE)
+#define PREDICT_TIMEOUT (TICKS_PER_SAMPLE << PREDICT_SHIFT)
+
+#if PREDICT_CROSSINGS
+static int16_t velocity[2]; //change per sample of each filtered axis
+static _Bool predicted = 0; //the current direction was fired early and the stick hasn't got there yet
+static _Bool predict_stalled = 0; //a prediction was taken back and the projection is still out
+static uint16_t predicted_at; //when the current direction was fired early
+#endif
+
+//drain the sample ring through the filters, leaving the newest filtered pair in sample
+void drain_samples(uint16_t sample[2])
+{
+	uint16_t raw[2];
+	while(next_sample(raw))
+	{
+		uint16_t ud = filter_sample(&filters[AXIS_UD], raw[AXIS_UD]);
+		uint16_t lr = filter_sample(&filters[AXIS_LR], raw[AXIS_LR]);
+#if PREDICT_CROSSINGS
+		velocity[AXIS_UD] = ud - sample[AXIS_UD];
+		velocity[AXIS_LR] = lr - sample[AXIS_LR];
+#endif
+		sample[AXIS_UD] = ud;
+		sample[AXIS_LR] = lr;
+	}
+}
+
+// The classifier looks at both axes every time. The dominant axis picks the
+// direction, with some angular hysteresis so a stick pushed along a diagonal
+// doesn't flip between neighbours, and the deflection is then checked
+// against a circular (or square) dead zone whose radius comes from that
+// direction's enter or exit threshold.
+#define DEADZONE_CIRCULAR 1 //0 for a square dead zone
+#define ANGLE_HYSTERESIS 2 //the other axis has to win by 1/2^n to take over, roughly 14 degrees at 2
+
+#define SAMPLE_CENTER ((SAMPLE_MAX+1)/2)
+#define THRESHOLD_LEVEL(t) ((uint16_t)(t) << (SAMPLE_BITS-7))
+
+uchar get_pos(const uint16_t sample[2], uchar last_pos)
+{
+	int16_t dy = sample[AXIS_UD] - SAMPLE_CENTER;
+	int16_t dx = sample[AXIS_LR] - SAMPLE_CENTER;
+	uint16_t ay = dy < 0 ? -dy : dy;
+	uint16_t ax = dx < 0 ? -dx : dx;
+
+	//the axis we are already on gets a head start
+	_Bool vertical;
+	if(last_pos == UP || last_pos == DOWN)
+		vertical = ay + (ay >> ANGLE_HYSTERESIS) >= ax;
+	else if(last_pos == LEFT || last_pos == RIGHT)
+		vertical = ay >= ax + (ax >> ANGLE_HYSTERESIS);
+	else
+		vertical = ay >= ax;
+
+	uchar dir;
+	if(vertical)
+		dir = dy < 0 ? UP : DOWN;
+	else
+		dir = dx < 0 ? LEFT : RIGHT;
+
+	if(current_program.options & OPTION_EIGHT_WAY)
+	{
+		//diagonal once the minor axis is past about 23 degrees, staying there down to about 21
+		uint16_t major = vertical ? ay : ax;
+		uint16_t minor = vertical ? ax : ay;
+		uint16_t limit = last_pos >= UP_LEFT ? (major >> 2) + (major >> 3) : (major >> 1) - (major >> 4);
+		if(minor > limit)
+			dir = (dy < 0 ? UP_LEFT : DOWN_LEFT) + (dx >= 0);
+	}
+
+	//staying in a direction uses the wider exit threshold
+	uchar t = dir <= RIGHT ? dir-1 : (dir-UP_LEFT) >> 1;
+	uchar threshold = dir == last_pos ? current_program.exit_threshold[t] : current_program.enter_threshold[t];
+	uint16_t radius = SAMPLE_CENTER - THRESHOLD_LEVEL(threshold);
+
+#if DEADZONE_CIRCULAR
+	//compare squared magnitudes at 8 bits, which is plenty for a dead zone
+	uint16_t magnitude = square8(ax >> (SAMPLE_BITS-8)) + square8(ay >> (SAMPLE_BITS-8));
+	if(magnitude > square8(radius >> (SAMPLE_BITS-8)))
+		return dir;
+#else
+	if((vertical ? ay : ax) > radius)
+		return dir;
+#endif
 
 	return CENTER;
 }
 
+#if PREDICT_CROSSINGS
+//turn the classified position into the one to report, firing or holding directions the stick is about to reach
+uchar predict_pos(const uint16_t sample[2], uchar pos, uchar last_pos)
+{
+	if(pos != CENTER)
+	{
+		predicted = 0; //really there
+		predict_stalled = 0;
+		return pos;
+	}
+	if(last_pos != CENTER && !predicted)
+		return pos; //really left
+	uint16_t now = ticks();
+	if(predicted && now - predicted_at > PREDICT_TIMEOUT)
+	{
+		//the stick should have got there by now, take it back
+		predicted = 0;
+		predict_stalled = 1;
+		return CENTER;
+	}
+	if(last_pos == CENTER && ticks_to_poll() > (TICKS_PER_SAMPLE << PREDICT_SHIFT))
+		return pos; //the real crossing would still make the next poll, no need to guess
+
+	uint16_t projected[2];
+	for(uchar i=0;i<2;++i)
+	{
+		int16_t p = sample[i] + velocity[i] * (1 << PREDICT_SHIFT);
+		if(p < 0)
+			p = 0;
+		if(p > SAMPLE_MAX)
+			p = SAMPLE_MAX;
+		projected[i] = p;
+	}
+
+	pos = get_pos(projected, last_pos);
+	if(pos == CENTER)
+		predict_stalled = 0;
+	else if(predict_stalled)
+		pos = CENTER;
+	else if(!predicted)
+		predicted_at = now;
+	predicted = pos != CENTER;
+	return pos;
+}
+#endif
+
+// Every from->to pair of positions has an entry in transition_matrix, packing
+// the table slot of the leave event in the high nibble and of the enter
+// event in the low one. A flick straight from one direction to another
+// therefore gives both the release and the press, not just the release.
+#define NO_LEAVE 0x0 //leave slots always have bit 2 set so can't be 0
+#define NO_ENTER 0xF //enter slots never have bit 2 set so can't be 15
+
+#define TRANSITION(from,to) ((from) == (to) ? (NO_LEAVE << 4 | NO_ENTER) : \
+	((from) ? LEAVE_INDEX(from) << 4 : NO_LEAVE << 4) | ((to) ? ENTER_INDEX(to) : NO_ENTER))
+#define TRANSITION_ROW(from) { \
+	TRANSITION(from,CENTER), TRANSITION(from,UP), TRANSITION(from,DOWN), \
+	TRANSITION(from,LEFT), TRANSITION(from,RIGHT), TRANSITION(from,UP_LEFT), \
+	TRANSITION(from,UP_RIGHT), TRANSITION(from,DOWN_LEFT), TRANSITION(from,DOWN_RIGHT) }
+
+const PROGMEM uchar transition_matrix[9][9] = {
+	TRANSITION_ROW(CENTER), TRANSITION_ROW(UP), TRANSITION_ROW(DOWN),
+	TRANSITION_ROW(LEFT), TRANSITION_ROW(RIGHT), TRANSITION_ROW(UP_LEFT),
+	TRANSITION_ROW(UP_RIGHT), TRANSITION_ROW(DOWN_LEFT), TRANSITION_ROW(DOWN_RIGHT),
+};
+
+// Events wait here until endpoint 1 is free, so a transition that produces
+// two of them, or one that happens while a packet is still in flight, isn't
+// lost. Notes and program changes have a queue of their own that always
+// goes first, so a burst of controller changes can neither delay nor push
+// out a note off. Note ons share it with the note offs so the two can't
+// overtake each other. The continuous streams only get the endpoint when
+// both queues are empty.
+#define URGENT_QUEUE_SIZE 8 //must be a power of two
+#define CONTROL_QUEUE_SIZE 4 //must be a power of two
+
+typedef struct
+{
+	uchar head;
+	uchar tail;
+	uchar overflows;
+}
+event_ring;
+
+static USB_midi_msg urgent_queue[URGENT_QUEUE_SIZE];
+static USB_midi_msg control_queue[CONTROL_QUEUE_SIZE];
+static event_ring urgent_ring = {0};
+static event_ring control_ring = {0};
+static uint16_t event_queued_at; //ticks() when the queues last stopped being empty
+
+uchar events_queued(void)
+{
+	return ((urgent_ring.head - urgent_ring.tail) & (URGENT_QUEUE_SIZE - 1)) + ((control_ring.head - control_ring.tail) & (CONTROL_QUEUE_SIZE - 1));
+}
+
+static void ring_push(event_ring *ring, USB_midi_msg *queue, uchar size, const USB_midi_msg *msg)
+{
+	uchar next = (ring->head + 1) & (size - 1);
+	if(next == ring->tail)
+	{
+		++ring->overflows;
+		return;
+	}
+	queue[ring->head] = *msg;
+	ring->head = next;
+}
+
+void queue_event(const USB_midi_msg *msg)
+{
+	if(!events_queued())
+		event_queued_at = ticks();
+
+	uchar type = msg->midi_header >> 4;
+	if(type == NOTE_ON || type == NOTE_OFF || type == PRG_CHANGE)
+		ring_push(&urgent_ring, urgent_queue, URGENT_QUEUE_SIZE, msg);
+	else
+		ring_push(&control_ring, control_queue, CONTROL_QUEUE_SIZE, msg);
+}
+
+static _Bool ring_pop(event_ring *ring, USB_midi_msg *queue, uchar size, USB_midi_msg *msg)
+{
+	if(ring->tail == ring->head)
+		return 0;
+	*msg = queue[ring->tail];
+	ring->tail = (ring->tail + 1) & (size - 1);
+	return 1;
+}
+
+//take the most urgent queued event, returns 0 if there was none
+_Bool next_event(USB_midi_msg *msg)
+{
+	return ring_pop(&urgent_ring, urgent_queue, URGENT_QUEUE_SIZE, msg) || ring_pop(&control_ring, control_queue, CONTROL_QUEUE_SIZE, msg);
+}
+
+// The travel starts when the stick leaves TRAVEL_CENTER, a square a little
+// bigger than the resting noise, and is timed with the Timer1 ticks.
+#define TRAVEL_CENTER (SAMPLE_CENTER/16)
+
+#define TRAVEL_SLOWEST (16 << 8) //ticks, the end of the last velocity bucket
+
+static uint16_t travel_start = 0;
+static _Bool travel_centered = 1;
+static _Bool travel_slowest = 0; //past TRAVEL_SLOWEST, set before ticks() can wrap round to a short time again
+
+void travel_update(const uint16_t sample[2])
+{
+	_Bool centered = 1;
+	for(uchar i=0;i<2;++i)
+		if(sample[i] < SAMPLE_CENTER - TRAVEL_CENTER || sample[i] > SAMPLE_CENTER + TRAVEL_CENTER)
+			centered = 0;
+	if(centered)
+		travel_slowest = 0;
+	else if(travel_centered)
+		travel_start = ticks();
+	else if((uint16_t)(ticks() - travel_start) >= TRAVEL_SLOWEST)
+		travel_slowest = 1;
+	travel_centered = centered;
+}
+
+//velocity for a note on now, 0 when the preset doesn't sense it
+uchar travel_velocity(void)
+{
+	if(!current_program.velocity_fast)
+		return 0;
+
+	uint16_t time = ticks() - travel_start;
+	if(travel_slowest) //time may have wrapped
+		return velocity_at(VELOCITY_BUCKETS - 1);
+	if(time < 16 || travel_centered)
+		return velocity_at(0);
+	if(time >= TRAVEL_SLOWEST)
+		return velocity_at(VELOCITY_BUCKETS - 1);
+	uchar octave = 4;
+	while(time >> (octave + 1))
+		++octave;
+	return velocity_at(((octave - 4) << 2) | ((time >> (octave - 2)) & 3));
+}
+
+//queue whatever a direction_lookup_table slot asks for, in program change mode up and down step the program instead
+void direction_event(uchar move, _Bool mode, uchar *prog)
+{
+	if(mode==0||move&(2|8))
+	{
+		USB_midi_msg msg = current_program.direction_lookup_table[move];
+		if(msg.bytes[0] != 0)
+		{
+			//a note on with velocity 0 is a note off, leave those alone
+			uchar velocity = (msg.midi_header >> 4) == NOTE_ON && msg.midi_arg2 ? travel_velocity() : 0;
+			if(velocity)
+				msg.midi_arg2 = velocity;
+			queue_event(&msg);
+		}
+	}
+	else
+	{
+		if(!(move&4))
+		{
+			if(move)
+				--*prog;
+			else
+				++*prog;
+			*prog&=127;
+			queue_event(&(USB_midi_msg){.packet_header=0x0C,.midi_header=0xC0,.midi_arg1=*prog, .midi_arg2=0});
+		}
+	}
+}
+
+#define NOTE_VELOCITY 100
+#define NOTE_HYSTERESIS 3 //in 1/256ths of an octave, 3/8 of a zone
+
+//note at a position in 1/256ths of an octave above the root
+static uchar note_at(int16_t position)
+{
+	if(position < 0)
+		position = 0;
+	uchar octave = position >> 8;
+	uchar zone = (position >> 3) & (NOTE_ZONES-1);
+	uchar pair = note_zones[zone >> 1];
+	uint16_t note = current_program.note_root + (octave << 3) + (octave << 2) + (zone & 1 ? pair >> 4 : pair & 0xf);
+	return note > 127 ? 127 : note;
+}
+
+//queue note on and off as the stick moves, a note held across a preset change or out of note mode is still let go
+void note_pass(const uint16_t sample[2])
+{
+	static USB_midi_msg playing = {.bytes = {0}}; //note off for the sounding note
+	static uchar gate_pos = CENTER;
+
+	_Bool gate = 0;
+	if(current_program.options & OPTION_NOTES)
+	{
+		if(current_program.note_gate == NOTE_GATE_AXIS)
+		{
+			uint16_t other = sample[!current_program.note_axis];
+			uint16_t deflection = other > SAMPLE_CENTER ? other - SAMPLE_CENTER : SAMPLE_CENTER - other;
+			uchar threshold = playing.bytes[0] ? current_program.exit_threshold[0] : current_program.enter_threshold[0];
+			gate = deflection > SAMPLE_CENTER - THRESHOLD_LEVEL(threshold);
+		}
+		else
+		{
+			gate_pos = get_pos(sample, gate_pos);
+			gate = gate_pos != CENTER;
+		}
+	}
+
+	if(!gate)
+	{
+		if(playing.bytes[0])
+		{
+			queue_event(&playing);
+			playing.bytes[0] = 0;
+		}
+		return;
+	}
+
+	int16_t position = kernel_scale(sample[current_program.note_axis], note_kernel);
+	uchar note = note_at(position);
+	if(playing.bytes[0])
+	{
+		//stay on the sounding note until the stick is well into the next zone
+		if(note == playing.midi_arg1 || note_at(position - NOTE_HYSTERESIS) == playing.midi_arg1 || note_at(position + NOTE_HYSTERESIS) == playing.midi_arg1)
+			return;
+		queue_event(&playing);
+	}
+
+	playing = (USB_midi_msg){.packet_header=0x08, .midi_header=0x80 | current_program.note_channel, .midi_arg1=note, .midi_arg2=0};
+	uchar velocity = travel_velocity();
+	queue_event(&(USB_midi_msg){.packet_header=0x09, .midi_header=0x90 | current_program.note_channel, .midi_arg1=note, .midi_arg2=velocity ? velocity : NOTE_VELOCITY});
+}
+
+// Pitch bend mode maps each axis through the calibration block. Outside the
+// dead zone the bend grows linearly with the deflection until it reaches the
+// half axis' limit, and the two axes are added. The slopes are scaling
+// kernels, so per sample this is a subtract, a few shifts and adds and a
+// clamp. Axis 0 of the calibration is the sideways one.
+#define BEND_CENTER 8192
+#define BEND_MAX 16383
+
+typedef struct
+{
+	uint16_t edge; //12 bit sample where the dead zone ends
+	uint8_t slope[KERNEL_TERMS]; //bend per sample of deflection
+	int16_t limit; //bend at full deflection, its sign is the direction of the bend
+}
+bend_half;
+
+typedef struct
+{
+	uint16_t edge;
+	uint16_t slope; //8.8 fixed point, turned into a kernel on load
+	int16_t limit;
+}
+bend_default;
+
+static bend_half bend_halves[4]; //LR low and high, UD low and high
+
+//without a calibration, bend LR over the whole travel past a small dead zone and ignore UD
+#define DEFAULT_BEND_DEAD_ZONE 128
+#define DEFAULT_BEND_SLOPE ((uint16_t)(256UL * BEND_CENTER / (SAMPLE_CENTER - DEFAULT_BEND_DEAD_ZONE)))
+
+const PROGMEM bend_default default_bend_halves[4] = {
+	{.edge = SAMPLE_CENTER - DEFAULT_BEND_DEAD_ZONE, .slope = DEFAULT_BEND_SLOPE, .limit = -BEND_CENTER},
+	{.edge = SAMPLE_CENTER + DEFAULT_BEND_DEAD_ZONE, .slope = DEFAULT_BEND_SLOPE, .limit = BEND_MAX - BEND_CENTER},
+	{.edge = SAMPLE_CENTER - DEFAULT_BEND_DEAD_ZONE, .slope = 0, .limit = 0},
+	{.edge = SAMPLE_CENTER + DEFAULT_BEND_DEAD_ZONE, .slope = 0, .limit = 0},
+};
+
+//|IEEE754 single| per 10 bit count to 8.8 fixed point per 12 bit sample, with integer ops only
+static uint16_t float_to_slope(const uchar *f)
+{
+	uchar exponent = f[3] << 1 | f[2] >> 7;
+	uint32_t mantissa = (uint32_t)(f[2] | 0x80) << 16 | (uint16_t)f[1] << 8 | f[0];
+
+	//the value is mantissa * 2^(exponent-150) and we want value * 2^8 / 4
+	if(exponent >= 144)
+		return 0xffff;
+	if(exponent <= 144-24)
+		return 0;
+	mantissa >>= 144 - exponent;
+	return mantissa > 0xffff ? 0xffff : mantissa;
+}
+
+//straight from the EEPROM rather than through a copy of the block, the stack can't spare 48 bytes
+void load_calibration(void)
+{
+	const uchar *block = (const uchar *)CALIBRATION_ADDR;
+
+	if((eeprom_read_byte(block + 3) & 0x7f) == 0x7f && (eeprom_read_byte(block + 2) & 0x80)) //NaN, the block was never written
+	{
+		for(uchar i=0;i<4;++i)
+		{
+			bend_halves[i].edge = pgm_read_word(&default_bend_halves[i].edge);
+			bend_halves[i].limit = pgm_read_word(&default_bend_halves[i].limit);
+			kernel_encode(pgm_read_word(&default_bend_halves[i].slope), bend_halves[i].slope);
+		}
+		return;
+	}
+
+	for(uchar i=0;i<4;++i)
+	{
+		eeprom_read_block(bend_halves[i].slope, block + 32 + 4*i, KERNEL_TERMS);
+		if(bend_halves[i].slope[0] == KERNEL_END) //written by an older calibration.htm, or the slope is zero
+		{
+			uchar f[4];
+			eeprom_read_block(f, block + 4*i, sizeof(f));
+			kernel_encode(float_to_slope(f), bend_halves[i].slope);
+		}
+		bend_halves[i].edge = eeprom_read_word((const uint16_t *)(block + 16 + 2*i)) << 2;
+		bend_halves[i].limit = eeprom_read_word((const uint16_t *)(block + 24 + 2*i));
+	}
+}
+
+//bend contributed by one axis, given its low and high halves
+static int16_t axis_bend(uint16_t s, const bend_half *low)
+{
+	const bend_half *half;
+	uint16_t deflection;
+	if(s < low[0].edge)
+	{
+		half = &low[0];
+		deflection = low[0].edge - s;
+	}
+	else if(s > low[1].edge)
+	{
+		half = &low[1];
+		deflection = s - low[1].edge;
+	}
+	else
+		return 0;
+
+	uint16_t limit = half->limit < 0 ? -half->limit : half->limit;
+	uint16_t bend = kernel_scale(deflection, half->slope);
+	if(bend > limit)
+		bend = limit;
+	return half->limit < 0 ? -(int16_t)bend : (int16_t)bend;
+}
+
+//a curve's output is the bend itself, 12 bits centered on SAMPLE_CENTER
+static int16_t curve_bend(const uint16_t sample[2], uchar axis)
+{
+	return ((int16_t)curve_lookup(sample[axis], current_program.curve[axis]) - SAMPLE_CENTER) << (14 - SAMPLE_BITS);
+}
+
+uint16_t pitch_bend(const uint16_t sample[2])
+{
+	int16_t bend = BEND_CENTER;
+	if(current_program.options & OPTION_CURVES)
+		bend += curve_bend(sample, AXIS_LR) + curve_bend(sample, AXIS_UD);
+	else
+		bend += axis_bend(sample[AXIS_LR], &bend_halves[0]) + axis_bend(sample[AXIS_UD], &bend_halves[2]);
+	if(bend < 0)
+		return 0;
+	if(bend > BEND_MAX)
+		return BEND_MAX;
+	return bend;
+}
+
+//12 bit value a route reads from its axis
+static uint16_t route_source(uint16_t v, const route *r)
+{
+	switch(r->half)
+	{
+	case ROUTE_LOW:
+		v = v < SAMPLE_CENTER ? ((SAMPLE_CENTER - v) << 1) - 1 : 0;
+		break;
+	case ROUTE_HIGH:
+		v = v > SAMPLE_CENTER ? (v - SAMPLE_CENTER) << 1 : 0;
+		break;
+	}
+	return v;
+}
+
+//POLAR_MAGNITUDE and POLAR_ANGLE sources from both axes
+static void polar_sources(const uint16_t axes[2], uint16_t out[2])
+{
+	static uint16_t held_angle = 0;
+	uint16_t angle, magnitude;
+
+	polar(axes[AXIS_LR] - SAMPLE_CENTER, axes[AXIS_UD] - SAMPLE_CENTER, &angle, &magnitude);
+	out[POLAR_MAGNITUDE] = magnitude >= SAMPLE_CENTER ? SAMPLE_MAX : magnitude << 1;
+	if(magnitude >= POLAR_HOLD)
+		held_angle = angle >> (16 - SAMPLE_BITS);
+	out[POLAR_ANGLE] = held_angle;
+}
+
+//whether route i should send value, delta away from the last one sent, now, in which case it is taken as sent
+static _Bool route_due_by(uchar i, uint16_t value, uint16_t delta)
+{
+	uint16_t now = ticks();
+
+	if(route_last[i] != 0xffff) //the first value after a reset always goes
+	{
+		route r = {.bytes = {0}};
+		if(i < ROUTES) //the OPTION_PITCH_BEND bend has no settings
+			r = current_program.routes[i];
+		uint16_t since = now - route_sent[i];
+		if(r.rate && since < (ROUTE_RATE_TICKS << r.rate))
+			return 0;
+		if(delta < (1 << r.min_delta) && !(r.keep_alive && since >= (ROUTE_KEEP_ALIVE_TICKS << (r.keep_alive-1))))
+			return 0;
+	}
+
+	route_last[i] = value;
+	route_sent[i] = now;
+	return 1;
+}
+
+static _Bool route_due(uchar i, uint16_t value)
+{
+	uint16_t last = route_last[i];
+	return route_due_by(i, value, value > last ? value - last : last - value);
+}
+
+// A route's 2 bit slew setting limits how fast its value moves, so a stick
+// let go sweeps back instead of jumping. 0 is off, 1, 2 and 3 allow a step
+// of 1/8, 1/32 and 1/128 of the destination's range every SLEW_TICKS, a
+// full sweep in 80ms, 320ms or 1.3s. Passes only run when endpoint 1 is
+// idle, so the sweep uses transfers nothing else wanted, and a pass that
+// comes several periods late takes that many steps at once.
+#define SLEW_TICKS (10*TICKS_PER_MS)
+#define SLEW_PERIODS_MAX 128 //a full sweep at the slowest rate, any more are dropped
+
+static uchar slew_periods; //whole SLEW_TICKS since the last step, set by route_pass()
+
+static uint16_t slew(uchar i, uint16_t target, uchar bits)
+{
+	uint16_t settings = current_program.slew[0] | (uint16_t)current_program.slew[1] << 7;
+	uchar rate = (settings >> (2*i)) & 3;
+	uint16_t now = route_slewed[i];
+
+	if(rate && now != 0xffff) //the first value after a reset goes straight there
+	{
+		if(!slew_periods)
+			return now;
+		if(slew_periods < (1 << (2*rate + 1))) //any more and the whole range is allowed
+		{
+			uint16_t step = (uint16_t)slew_periods << (bits - 1 - 2*rate);
+			if(target > now + step)
+				target = now + step;
+			else if(target + step < now)
+				target = now - step;
+		}
+	}
+	route_slewed[i] = target;
+	return target;
+}
+
+//whether two control messages set the same thing, controllers and poly pressure by their number
+static _Bool same_control(const USB_midi_msg *a, const USB_midi_msg *b)
+{
+	if(a->packet_header != b->packet_header || a->midi_header != b->midi_header)
+		return 0;
+	uchar type = a->midi_header >> 4;
+	return (type != CONTROLLER && type != POLY_PRESS) || a->midi_arg1 == b->midi_arg1;
+}
+
+//where a value for the same control is still waiting in the batch, or a new slot at the end, pairs are only matched by pairs
+//callers tell the two apart by whether stream_batch_len grew
+static uchar stream_slot(const USB_midi_msg *msg, _Bool pair)
+{
+	for(uchar i=stream_batch_pos;i<stream_batch_len;++i)
+	{
+		_Bool starts = (stream_pairs >> i) & 1;
+		if(starts == pair && same_control(&stream_batch[i], msg))
+			return i;
+		i += starts; //a pair's LSB never matches on its own
+	}
+	return stream_batch_len++;
+}
+
+//append a route's packet to the batch if it is due
+static void route_packets(uchar i, uint16_t value, uchar cin, uchar status, uchar arg1, uchar arg2)
+{
+	if(!route_due(i, value))
+		return;
+	USB_midi_msg msg = {.packet_header=cin, .midi_header=status, .midi_arg1=arg1, .midi_arg2=arg2};
+	stream_batch[stream_slot(&msg, 0)] = msg;
+}
+
+//one pass over the routes for the latest sample
+void route_pass(const uint16_t sample[2])
+{
+	uint16_t axes[2] = {sample[AXIS_UD], sample[AXIS_LR]};
+	uint16_t polar_values[2];
+	_Bool polar_done = 0; //only worked out when a route wants it
+
+	static uint16_t slew_time = 0;
+	uint16_t now = ticks();
+	slew_periods = 0;
+	while(now - slew_time >= SLEW_TICKS)
+	{
+		slew_time += SLEW_TICKS;
+		if(++slew_periods == SLEW_PERIODS_MAX)
+		{
+			slew_time = now;
+			break;
+		}
+	}
+
+	if(current_program.options & OPTION_PITCH_BEND)
+	{
+		uint16_t bend = slew(ROUTES, pitch_bend(sample), 14);
+		route_packets(ROUTES, bend, 0x0E, 0xE0, bend & 0x7f, bend >> 7);
+	}
+
+	if(current_program.options & OPTION_CURVES)
+	{
+		axes[AXIS_UD] = curve_lookup(axes[AXIS_UD], current_program.curve[AXIS_UD]);
+		axes[AXIS_LR] = curve_lookup(axes[AXIS_LR], current_program.curve[AXIS_LR]);
+	}
+
+	for(uchar i=0;i<ROUTES;++i)
+	{
+		const route *r = &current_program.routes[i];
+		if(r->destination == ROUTE_NONE)
+			continue;
+
+		uint16_t v;
+		if(r->half == ROUTE_POLAR)
+		{
+			if(!polar_done)
+			{
+				polar_sources(axes, polar_values);
+				polar_done = 1;
+			}
+			v = polar_values[r->axis];
+		}
+		else
+			v = route_source(axes[r->axis], r);
+
+		uchar channel = r->channel;
+		uchar number = r->number & 0x7f;
+		switch(r->destination)
+		{
+		case ROUTE_PITCH_BEND:
+		{
+			uint16_t bend = r->half == ROUTE_LOW ? BEND_CENTER - (v << 1) : r->half == ROUTE_HIGH ? BEND_CENTER + (v << 1) : v << 2;
+			bend = slew(i, bend, 14);
+			route_packets(i, bend, 0x0E, 0xE0 | channel, bend & 0x7f, bend >> 7);
+			break;
+		}
+		case ROUTE_CC:
+			v = slew(i, v >> 5, 7);
+			route_packets(i, v, 0x0B, 0xB0 | channel, number, v);
+			break;
+		case ROUTE_CC14:
+		{
+			uint16_t value = slew(i, v << 2, 14);
+			if(!route_due(i, value))
+				break;
+			USB_midi_msg msb = {.packet_header=0x0B, .midi_header=0xB0 | channel, .midi_arg1=number & 31, .midi_arg2=value >> 7};
+			uchar len = stream_batch_len;
+			uchar at = stream_slot(&msb, 1);
+			if(stream_batch_len != len) //not waiting already
+			{
+				//pairs only ever start at even offsets, so at an odd length the last packet is a single, move it after the pair
+				at &= ~1;
+				stream_batch[stream_batch_len] = stream_batch[at];
+				stream_pairs |= 1 << at;
+				++stream_batch_len;
+			}
+			stream_batch[at] = msb;
+			stream_batch[at + 1] = (USB_midi_msg){.packet_header=0x0B, .midi_header=0xB0 | channel, .midi_arg1=(number & 31) + 32, .midi_arg2=value & 0x7f};
+			break;
+		}
+		case ROUTE_CHAN_PRESS:
+			v = slew(i, v >> 5, 7);
+			route_packets(i, v, 0x0D, 0xD0 | channel, v, 0);
+			break;
+		case ROUTE_POLY_PRESS:
+			v = slew(i, v >> 5, 7);
+			route_packets(i, v, 0x0A, 0xA0 | channel, number, v);
+			break;
+		case ROUTE_CC_RELATIVE:
+		{
+			uchar value = v >> 5;
+			if(route_last[i] == 0xffff) //nothing to be relative to yet
+			{
+				route_last[i] = value;
+				break;
+			}
+			int8_t change = (int8_t)((value - route_last[i]) << 1) >> 1; //the shortest way round
+			if(!change || !route_due_by(i, value, change < 0 ? -change : change)) //the change sent, not the distance across the wrap
+				break;
+			USB_midi_msg msg = {.packet_header=0x0B, .midi_header=0xB0 | channel, .midi_arg1=number, .midi_arg2=64};
+			uchar len = stream_batch_len;
+			uchar at = stream_slot(&msg, 0);
+			if(stream_batch_len == len) //a change still waiting, send the two as one
+				change += stream_batch[at].midi_arg2 - 64;
+			msg.midi_arg2 = change < -63 ? 1 : change > 63 ? 127 : 64 + change;
+			stream_batch[at] = msg;
+			break;
+		}
+		}
+	}
+}
+
+//up to room packets built from the latest sample, only call close to the host's poll, returns how many
+uchar stream_packets(USB_midi_msg *out, uchar room, const uint16_t sample[2])
+{
+	if(calibration_mode)
+	{
+		//raw 10 bit axes the way calibration.htm draws them, always a transfer of their own
+		if(room < 2)
+			return 0;
+		uint16_t lr = sample[AXIS_LR] >> 2;
+		uint16_t ud = sample[AXIS_UD] >> 2;
+		out[0] = (USB_midi_msg){.packet_header=0x0E, .midi_header=0xE1, .midi_arg1=lr & 0x7f, .midi_arg2=lr >> 7};
+		out[1] = (USB_midi_msg){.packet_header=0x0E, .midi_header=0xE2, .midi_arg1=ud & 0x7f, .midi_arg2=ud >> 7};
+		return 2;
+	}
+
+	if(stream_batch_pos == stream_batch_len)
+	{
+		stream_batch_len = 0;
+		stream_batch_pos = 0;
+		stream_pairs = 0;
+	}
+	else
+	{
+		//drop what has gone, an even number so the pairs stay even, and let this pass refresh the rest
+		uchar sent = stream_batch_pos & ~1;
+		memmove(stream_batch, stream_batch + sent, (stream_batch_len - sent) * sizeof(USB_midi_msg));
+		stream_batch_len -= sent;
+		stream_batch_pos -= sent;
+		stream_pairs >>= sent;
+	}
+	route_pass(sample);
+
+	uchar count = 0;
+	while(count < room && stream_batch_pos < stream_batch_len)
+	{
+		if(stream_pairs & (1 << stream_batch_pos))
+		{
+			if(room - count < 2)
+				break;
+			out[count++] = stream_batch[stream_batch_pos++];
+		}
+		out[count++] = stream_batch[stream_batch_pos++];
+	}
+	return count;
+}
+
+// Each transfer carries two packets. Queued events take the first places,
+// the stream fills what's left once the poll is close. A lone event is held
+// back while the poll is still more than POLL_LEAD away, for up to
+// PAIR_WAIT, since a second event (the note on after a note off, say) or
+// the stream may still join it. Armed any time before the poll it goes out
+// on the same poll, so the wait costs nothing unless the poll schedule is
+// wrong, and PAIR_WAIT bounds that.
+#define PAIR_WAIT (2*TICKS_PER_MS)
+
+//fill and arm one transfer, only call when usbInterruptIsReady()
+void send_transfer(const uint16_t sample[2])
+{
+	USB_midi_msg msg[2];
+	_Bool window = poll_window_open();
+
+	if(events_queued() == 1 && !window && (uint16_t)(ticks() - event_queued_at) < PAIR_WAIT)
+		return;
+
+	uchar count = 0;
+	while(count < 2 && next_event(&msg[count]))
+		++count;
+	if(window && count < 2)
+		count += stream_packets(&msg[count], 2 - count, sample);
+	if(!count)
+		return;
+
+	usbSetInterrupt(msg[0].bytes, count*sizeof(USB_midi_msg));
+	poll_armed();
+}
+
 typedef union
 {
 	uchar bytes[4];
@@ -524,7 +2011,7 @@ midimsg;
 
 
 
-midimsg lookuptable[] = {
+const PROGMEM midimsg lookuptable[] = {
 	(midimsg){.codeindex=0xB, .channel=0, .msg_type=0xB, .controller=100, .value=100},
 	(midimsg){.codeindex=0xB, .channel=0, .msg_type=0xB, .controller=101, .value=100},
 	(midimsg){.codeindex=0xB, .channel=0, .msg_type=0xB, .controller=102, .value=100},
@@ -576,6 +2063,7 @@ void main(void)
 	wdt_disable();
 
 	usbDeviceDisconnect();
+	presets_migrate(); //slow the first time, while the host can't see us anyway
 	for(uchar i=0;i<250;i++)
 	{
 		//wdt_reset();
@@ -585,13 +2073,21 @@ void main(void)
 	
 
 	usbInit();
+	tick_start();
 	sei();
 
-	ADCSRA = 1 << ADEN | 0b110; //enable ADC and set prescaler to 6 (divide by 64)
+	adc_start();
+	load_calibration();
+
+	uint16_t sample[2];
+	while(!next_sample(sample)) //wait for the first pair
+		;
+	filter_init(&filters[AXIS_UD], sample[AXIS_UD]);
+	filter_init(&filters[AXIS_LR], sample[AXIS_LR]);
 
 	_Bool mode = 0;
 	uchar prog = 0;
-	uchar last_pos = get_pos();
+	uchar last_pos = get_pos(sample, CENTER);
 	switch(last_pos)
 	{
 	case UP:
@@ -615,43 +2111,39 @@ void main(void)
 	for(;;)
 	{		
 		usbPoll();
-		if(usbInterruptIsReady())
+		drain_samples(sample);
+		if(toggle_mode)
 		{
-			if(toggle_mode)
-			{
-				toggle_mode=0;
-				mode = !mode;
-			}
-			uchar pos = get_pos();
+			toggle_mode=0;
+			mode = !mode;
+		}
+		if(calibration_written)
+		{
+			calibration_written=0;
+			load_calibration();
+		}
+		travel_update(sample);
+		note_pass(sample);
+		if(!(current_program.options & (OPTION_PITCH_BEND | OPTION_NOTES)))
+		{
+			uchar pos = get_pos(sample, last_pos);
+#if PREDICT_CROSSINGS
+			pos = predict_pos(sample, pos, last_pos);
+#endif
 			if(pos != last_pos)
 			{
-				uchar move;
-				if(last_pos)
-					move=last_pos+3;
-				else
-					move=pos-1;
+				uchar transition = pgm_read_byte(&transition_matrix[last_pos][pos]);
 				last_pos = pos;
-				if(mode==0||move&2)
-				{
-					if(current_program.direction_lookup_table[move].bytes[0] != 0)
-						usbSetInterrupt(current_program.direction_lookup_table[move].bytes,sizeof(USB_midi_msg));
-				}
-				else
-				{
-					if(!(move&4))
-					{
-						if(move)
-							--prog;
-						else
-							++prog;
-						prog&=127;
-						usbSetInterrupt((USB_midi_msg){.packet_header=0x0C,.midi_header=0xC0,.midi_arg1=prog, .midi_arg2=0}.bytes,sizeof(USB_midi_msg));
-					}
-				}
-				
+				if((transition >> 4) != NO_LEAVE)
+					direction_event(transition >> 4, mode, &prog);
+				if((transition & 0xf) != NO_ENTER)
+					direction_event(transition & 0xf, mode, &prog);
 			}
 		}
-
+		if(usbInterruptIsReady())
+		{
+			send_transfer(sample);
+		}
 	}
 }
 
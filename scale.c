@@ -0,0 +1,142 @@
+/* Multiply-free scaling kernels
+ * See scale.h
+ */
+
+#include <avr/pgmspace.h>
+
+#include "scale.h"
+
+uint16_t kernel_scale(uint16_t x, const uint8_t kernel[KERNEL_TERMS])
+{
+	uint16_t v = x << 4;
+	uint8_t shifted = 0;
+	int32_t result = 0;
+
+	for(uint8_t i=0;i<KERNEL_TERMS;++i)
+	{
+		uint8_t term = kernel[i];
+		uint8_t shift = term & KERNEL_SHIFT;
+		if(shift > KERNEL_MAX_SHIFT) //KERNEL_END
+			break;
+		while(shifted < shift) //terms come in increasing shift order, so at most 12 of these in total
+		{
+			v >>= 1;
+			++shifted;
+		}
+		if(term & KERNEL_SUBTRACT)
+			result -= v;
+		else
+			result += v;
+	}
+
+	if(result < 0)
+		return 0;
+	if(result > 0xffff)
+		return 0xffff;
+	return result;
+}
+
+void kernel_encode(uint16_t constant, uint8_t kernel[KERNEL_TERMS])
+{
+	int16_t rest = constant > 0x1fff ? 0x1fff : constant; //16 in 8.8 is the largest power we have
+
+	for(uint8_t i=0;i<KERNEL_TERMS;++i)
+	{
+		if(rest == 0)
+		{
+			kernel[i] = KERNEL_END;
+			continue;
+		}
+
+		uint16_t magnitude = rest < 0 ? -rest : rest;
+		uint8_t power = 0;
+		while(magnitude >> (power + 1))
+			++power;
+		//round to the nearer of the two powers either side
+		if(power < 8 + 4 && magnitude - (1 << power) > (2 << power) - magnitude)
+			++power;
+
+		kernel[i] = (rest < 0 ? KERNEL_SUBTRACT : 0) | (KERNEL_MAX_SHIFT - power);
+		if(rest < 0)
+			rest += 1 << power;
+		else
+			rest -= 1 << power;
+	}
+}
+
+uint16_t curve_lookup(uint16_t x, const uint8_t points[CURVE_POINTS])
+{
+	const uint8_t *p = points + (x >> CURVE_SEGMENT_BITS);
+	uint16_t frac = x;
+	int16_t delta = ((int16_t)p[1] - p[0]) << 5;
+	int16_t step = 0;
+
+	//step = delta * frac / segment width, taking the bits of frac lsb first
+	for(uint8_t i=0;i<CURVE_SEGMENT_BITS;++i)
+	{
+		step += delta & -(int16_t)(frac & 1);
+		step >>= 1;
+		frac >>= 1;
+	}
+
+	int16_t y = ((int16_t)p[0] << 5) + step;
+	return y & ~(y >> 15); //the shifts round down, so a falling segment can end up at -1
+}
+
+//atan(2^-i) in 1/65536 of a turn
+const PROGMEM uint16_t cordic_atan[CORDIC_ITERATIONS] = {8192, 4836, 2555, 1297, 651, 326, 163, 81, 41, 20, 10, 5};
+
+//undoes the CORDIC gain of 1.647 and the scaling below, 311/256
+static const uint8_t cordic_gain[KERNEL_TERMS] = {4, 6, KERNEL_SUBTRACT | 9, KERNEL_SUBTRACT | 12};
+
+void polar(int16_t x, int16_t y, uint16_t *angle, uint16_t *magnitude)
+{
+	uint16_t a = 0;
+
+	//CORDIC only converges within a quarter turn or so of +x
+	if(x < 0)
+	{
+		x = -x;
+		y = -y;
+		a = 0x8000;
+	}
+	//two more bits of precision, the gain takes the magnitude up to 2048*1.414*1.647*4 which still fits
+	x <<= 2;
+	y <<= 2;
+
+	for(uint8_t i=0;i<CORDIC_ITERATIONS;++i)
+	{
+		int16_t dx = x >> i;
+		int16_t dy = y >> i;
+		uint16_t step = pgm_read_word(&cordic_atan[i]);
+		if(y > 0)
+		{
+			x += dy;
+			y -= dx;
+			a += step;
+		}
+		else
+		{
+			x -= dy;
+			y += dx;
+			a -= step;
+		}
+	}
+
+	*angle = a;
+	*magnitude = kernel_scale((uint16_t)x >> 3, cordic_gain);
+}
+
+uint16_t square8(uint8_t x)
+{
+	uint16_t result = 0;
+	uint16_t addend = x;
+	for(uint8_t i=0;i<8;++i)
+	{
+		if(x & 1)
+			result += addend;
+		x >>= 1;
+		addend <<= 1;
+	}
+	return result;
+}
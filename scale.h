@@ -0,0 +1,63 @@
+/* Multiply-free scaling kernels
+ * The ATtiny85 has no MUL instruction, so every x * constant on the hot path
+ * would otherwise be a libgcc call. These do the same with shifts and adds.
+ */
+
+#ifndef __scale_h_included__
+#define __scale_h_included__
+
+#include <stdint.h>
+
+// A kernel multiplies a 12 bit value by a constant held as up to
+// KERNEL_TERMS signed powers of two. Each term byte is a right shift of
+// x << 4 (0 to 12, so the constant's powers run from 1/256 up to 16) with
+// KERNEL_SUBTRACT set for a negative term. Terms are stored in increasing
+// shift order and KERNEL_END marks an unused one, so an erased EEPROM reads
+// as an empty kernel. calibration.htm builds them on the host.
+//
+// kernel_scale() does at most 12 single bit shifts of a 16 bit value and
+// KERNEL_TERMS adds, so its cost is bounded by the kernel rather than the
+// operand. `make bench` measures it against soft-float and libgcc.
+#define KERNEL_TERMS 4
+#define KERNEL_SUBTRACT 0x80
+#define KERNEL_SHIFT 0x0f
+#define KERNEL_END 0xff
+#define KERNEL_MAX_SHIFT 12
+
+//x * constant, saturated to 16 bits, x must fit in 12 bits
+uint16_t kernel_scale(uint16_t x, const uint8_t kernel[KERNEL_TERMS]);
+
+//greedy nearest power of two decomposition of an 8.8 fixed point constant below 32
+void kernel_encode(uint16_t constant, uint8_t kernel[KERNEL_TERMS]);
+
+//8x8 bit square
+uint16_t square8(uint8_t x);
+
+// A response curve is CURVE_POINTS 7 bit points spread evenly over the 12
+// bit input, the last one standing for the far end of the travel. Between
+// them curve_lookup() interpolates with one masked add and shift per bit of
+// the position within the segment, so it costs the same for any input.
+// The output is 12 bits, point << 5.
+#define CURVE_POINTS 9 //curve_lookup() also takes 17, but four presets of 17 point curves won't fit main.c's EEPROM
+
+#if CURVE_POINTS == 9
+#define CURVE_SEGMENT_BITS 9
+#elif CURVE_POINTS == 17
+#define CURVE_SEGMENT_BITS 8
+#else
+#error "CURVE_POINTS must be 9 or 17"
+#endif
+
+uint16_t curve_lookup(uint16_t x, const uint8_t points[CURVE_POINTS]);
+
+// polar() turns a deflection from the center into an angle and a magnitude
+// with CORDIC_ITERATIONS rounds of vectoring CORDIC, each a pair of shifts
+// and adds steered by a PROGMEM arctangent table. The angle is a 16 bit
+// fraction of a turn, 0 along +x and a quarter turn along +y. The magnitude
+// is in the units of x and y, which must stay within +-2048. The cost is
+// fixed by the iteration count, `make bench` measures it.
+#define CORDIC_ITERATIONS 12
+
+void polar(int16_t x, int16_t y, uint16_t *angle, uint16_t *magnitude);
+
+#endif /* __scale_h_included__ */
@@ -108,6 +108,14 @@ extern void usbEventResetReady(void);
  * one parameter which distinguishes between the start of RESET state and its
  * end.
  */
+#ifndef __ASSEMBLER__
+extern void usbEventInterruptSent(void);
+#endif
+#define USB_INTR1_SENT_HOOK()               usbEventInterruptSent();
+/* This macro is executed from usbPoll() once the host has collected the
+ * packet passed to usbSetInterrupt(). We use it to learn the phase of the
+ * host's polling of endpoint 1.
+ */
 #define USB_CFG_HAVE_MEASURE_FRAME_LENGTH   1
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
  * compiled in. This function can be used to calibrate the AVR's RC oscillator.
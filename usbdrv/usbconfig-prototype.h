@@ -171,6 +171,12 @@ section at the end of this file).
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
+/* #define USB_INTR1_SENT_HOOK()               interruptCollected(); */
+/* This macro (if defined) is executed from usbPoll() the first time it finds
+ * that the host has collected the packet passed to usbSetInterrupt(). The
+ * host's IN token came at most one usbPoll() interval earlier, so this can
+ * be used to learn when the host polls the interrupt endpoint.
+ */
 #define USB_COUNT_SOF                   0
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
@@ -240,9 +240,16 @@ char    i;
     DBG2(0x21 + (((int)txStatus >> 3) & 3), txStatus->buffer, len + 3);
 }
 
+#ifdef USB_INTR1_SENT_HOOK
+static uchar    usbTxArmed1;    /* set while a packet waits for the host to collect it */
+#endif
+
 USB_PUBLIC void usbSetInterrupt(uchar *data, uchar len)
 {
     usbGenericSetInterrupt(data, len, &usbTxStatus1);
+#ifdef USB_INTR1_SENT_HOOK
+    usbTxArmed1 = 1;
+#endif
 }
 #endif
 
@@ -591,6 +598,12 @@ uchar   i;
             usbBuildTxBlock();
         }
     }
+#if defined(USB_INTR1_SENT_HOOK) && USB_CFG_HAVE_INTRIN_ENDPOINT && !USB_CFG_SUPPRESS_INTR_CODE
+    if(usbTxArmed1 && usbInterruptIsReady()){   /* host has collected the packet since the last call */
+        usbTxArmed1 = 0;
+        USB_INTR1_SENT_HOOK();
+    }
+#endif
     for(i = 20; i > 0; i--){
         uchar usbLineStatus = USBIN & USBMASK;
         if(usbLineStatus != 0)  /* SE0 has ended */